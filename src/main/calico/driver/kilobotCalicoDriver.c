@@ -1,8 +1,258 @@
+#include <time.h>
+
 #include "kilobotCalicoDriver.h"
 
 // File descriptor for the overhead controller.
 int ohcFd = -1;
 
+// Sequence number of the last macro trigger; never zero once a trigger is sent.
+// Seeded per session so units still running from a previous session do not
+// mistake the first trigger for a repeat.
+uint8_t macroTriggerSequence = 0;
+
+// ID of the last bulk transfer, seeded per session like macroTriggerSequence.
+uint8_t bulkTransferId = 0;
+
+// Last command of one type sent to a unit, replayed after a reconnect.
+typedef struct UnitCommand {
+    // 1 if arg0/arg1 hold the unit's current values, and 0 if they are unknown.
+    uint8_t known;
+    uint8_t arg0;
+    uint8_t arg1;
+
+    // 1 if a deferred command is waiting for deferredTime, and 0 otherwise.
+    uint8_t deferred;
+    uint8_t deferredArg0;
+    uint8_t deferredArg1;
+    uint16_t deferredTime;
+} UnitCommand;
+UnitCommand unitMotors[256] = {{0}};
+UnitCommand unitColor[256] = {{0}};
+
+// Progress of the replay after a reconnect. Phases 0 and 1 replay pending
+// deferred motors and colors, and phases 2 and 3 replay current motors and
+// colors; -1 means no replay is in progress.
+#define CALICO_REPLAY_HOLD_MICROS 25000
+#define CALICO_REPLAY_PHASES 4
+int replayPhase = -1;
+int replayId = 0;
+uint64_t nextReplayMicros = 0;
+
+// Time a sync beacon is repeated for before it is stopped (two kilo ticks).
+#define CALICO_SYNC_HOLD_MICROS (2 * CALICO_TICK_MICROS)
+
+// Monotonic time at which the swarm clock started, in microseconds.
+uint64_t swarmEpochMicros = 0;
+
+/**
+ * Reads the system's monotonic clock.
+ *
+ * @return Monotonic time in microseconds.
+ */
+uint64_t _getMonotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Derives a value that differs between driver sessions, for seeding the
+ * sequence numbers units use to ignore repeated messages.
+ *
+ * @return Session seed.
+ */
+uint32_t _getSessionSeed() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint32_t) now.tv_nsec ^ (uint32_t) now.tv_sec ^ ((uint32_t) getpid() << 16);
+}
+
+/**
+ * Sends a message and keeps the overhead controller repeating it for a while,
+ * so that it reaches the swarm before the next message replaces it.
+ *
+ * @param message Message to send.
+ * @param holdMicros Time to keep repeating the message, in microseconds.
+ */
+void _sendAndHold(uint8_t* message, uint32_t holdMicros) {
+    kbSendMessage(ohcFd, message);
+    usleep(holdMicros);
+}
+
+/**
+ * Turns a unit's deferred command into its current value once its time has passed.
+ *
+ * @param command Command record of the unit.
+ * @param now Lower 16 bits of the current swarm time.
+ */
+void _settleCommand(UnitCommand* command, uint16_t now) {
+    if (command->deferred && (int16_t) (command->deferredTime - now) <= 0) {
+        command->known = 1;
+        command->arg0 = command->deferredArg0;
+        command->arg1 = command->deferredArg1;
+        command->deferred = 0;
+    }
+}
+
+/**
+ * Records a command sent to a range of units.
+ *
+ * @param table unitMotors or unitColor.
+ * @param deferred 1 if the command is applied at execTime, and 0 if it is applied immediately.
+ */
+void _recordCommand(UnitCommand* table, uint8_t idMin, uint8_t idMax, uint8_t arg0, uint8_t arg1,
+                    int deferred, uint16_t execTime) {
+    uint16_t now = (uint16_t) getSwarmTime();
+
+    int id;
+    for (id = idMin; id <= idMax; id++) {
+        _settleCommand(&table[id], now);
+
+        if (deferred) {
+            table[id].deferred = 1;
+            table[id].deferredArg0 = arg0;
+            table[id].deferredArg1 = arg1;
+            table[id].deferredTime = execTime;
+        } else {
+            table[id].known = 1;
+            table[id].arg0 = arg0;
+            table[id].arg1 = arg1;
+        }
+    }
+}
+
+/**
+ * Checks if a unit has a command to replay.
+ *
+ * @param deferred 1 to check the pending deferred command, and 0 to check the current value.
+ */
+int _hasCommand(UnitCommand* command, int deferred) {
+    return deferred ? command->deferred : command->known;
+}
+
+/**
+ * Checks if two units have the same command to replay.
+ *
+ * @param deferred 1 to compare pending deferred commands, and 0 to compare current values.
+ */
+int _isSameCommand(UnitCommand* one, UnitCommand* two, int deferred) {
+    if (deferred) {
+        return one->deferredArg0 == two->deferredArg0 &&
+               one->deferredArg1 == two->deferredArg1 &&
+               one->deferredTime == two->deferredTime;
+    } else {
+        return one->arg0 == two->arg0 && one->arg1 == two->arg1;
+    }
+}
+
+/**
+ * Builds the next replay message, merging runs of consecutive units with the
+ * same command into a single ranged message. Deferred commands still ahead of
+ * the swarm clock are replayed as MSG_DEFERRED so they keep their deadline.
+ *
+ * @param message Buffer to build the message in.
+ *
+ * @return 1 if a message was built, and 0 if the replay is complete.
+ */
+int _nextReplayMessage(uint8_t* message) {
+    uint16_t now = (uint16_t) getSwarmTime();
+
+    int id;
+    for (id = 0; id < 256; id++) {
+        _settleCommand(&unitMotors[id], now);
+        _settleCommand(&unitColor[id], now);
+    }
+
+    while (replayPhase < CALICO_REPLAY_PHASES) {
+        UnitCommand* table = replayPhase % 2 == 0 ? unitMotors : unitColor;
+        uint8_t type = replayPhase % 2 == 0 ? MSG_SET_MOTORS : MSG_SET_COLOR;
+        int deferred = replayPhase < 2;
+
+        while (replayId < 256) {
+            if (!_hasCommand(&table[replayId], deferred)) {
+                replayId++;
+                continue;
+            }
+
+            // Extend the range while the next unit has the same command.
+            int idMin = replayId;
+            int idMax = idMin;
+            while (idMax + 1 < 256 && _hasCommand(&table[idMax + 1], deferred) &&
+                   _isSameCommand(&table[idMin], &table[idMax + 1], deferred)) {
+                idMax++;
+            }
+            replayId = idMax + 1;
+
+            memset(message, 0, MSG_MAX_SIZE);
+            message[1] = idMin;
+            message[2] = idMax;
+
+            if (deferred) {
+                message[0] = MSG_DEFERRED;
+                message[3] = type;
+                message[4] = table[idMin].deferredArg0;
+                message[5] = table[idMin].deferredArg1;
+                message[6] = table[idMin].deferredTime & 0xFF;
+                message[7] = table[idMin].deferredTime >> 8;
+            } else {
+                message[0] = type;
+                message[3] = table[idMin].arg0;
+                message[4] = table[idMin].arg1;
+            }
+
+            return 1;
+        }
+
+        replayPhase++;
+        replayId = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Starts restoring the last commanded swarm state after the overhead controller
+ * reconnects. The replay itself is spread over later calls to pollCalicoDriver().
+ *
+ * @param fd File descriptor of the reconnected overhead controller.
+ */
+void _onOhcReconnect(int fd) {
+    fprintf(stderr, "Replaying swarm state after reconnecting the overhead controller.\n");
+    replayPhase = 0;
+    replayId = 0;
+    nextReplayMicros = 0;
+}
+
+/**
+ * Sends a command that is applied once the swarm clock reaches the given time.
+ *
+ * @param idMin The lowest unit ID that will receive the message.
+ * @param idMax The highest unit ID that will receive the message.
+ * @param type The command to defer (MSG_SET_COLOR or MSG_SET_MOTORS).
+ * @param arg0 First command argument.
+ * @param arg1 Second command argument.
+ * @param execTime Swarm time at which the command is applied.
+ */
+void _sendDeferred(uint8_t idMin, uint8_t idMax, uint8_t type, uint8_t arg0, uint8_t arg1, uint16_t execTime) {
+    // Prepare a message for sending.
+    uint8_t message[MSG_MAX_SIZE] = {0};
+
+    // Insert message metadata.
+    message[0] = MSG_DEFERRED;
+    message[1] = idMin;
+    message[2] = idMax;
+
+    // Insert message payload.
+    message[3] = type;
+    message[4] = arg0;
+    message[5] = arg1;
+    message[6] = execTime & 0xFF;
+    message[7] = execTime >> 8;
+
+    // Send the message.
+    kbSendMessage(ohcFd, message);
+}
+
 void initializeCalicoDriver(const char* overheadControllerAddress) {
 
     // Open the overhead controller.
@@ -13,10 +263,64 @@ void initializeCalicoDriver(const char* overheadControllerAddress) {
         fprintf(stderr, "Opening the overhead controller failed with code %d.\n", ohcFd);
     } else {
         fprintf(stderr, "Successfully opened the overhead controller with file descriptor %d.\n", ohcFd);
+
+        // Restore the swarm if the overhead controller is lost and reopened.
+        kbSetReconnectHandler(ohcFd, _onOhcReconnect);
     }
+
+    // Start the swarm clock.
+    swarmEpochMicros = _getMonotonicMicros();
+
+    // Start this session's sequence numbers somewhere new.
+    macroTriggerSequence = (uint8_t) _getSessionSeed();
+    bulkTransferId = (uint8_t) (_getSessionSeed() >> 8);
+}
+
+int pollCalicoDriver() {
+    int status = kbPoll(ohcFd);
+
+    // Send at most one replay message per call, each held for CALICO_REPLAY_HOLD_MICROS.
+    if (status == 1 && replayPhase >= 0 && _getMonotonicMicros() >= nextReplayMicros) {
+        uint8_t message[MSG_MAX_SIZE];
+        if (_nextReplayMessage(message)) {
+            kbSendReplayMessage(ohcFd, message);
+            nextReplayMicros = _getMonotonicMicros() + CALICO_REPLAY_HOLD_MICROS;
+        } else {
+            // Go back to whatever the overhead controller was sending before.
+            replayPhase = -1;
+            kbResume(ohcFd);
+        }
+    }
+
+    return status;
+}
+
+uint32_t getSwarmTime() {
+    return (uint32_t) ((_getMonotonicMicros() - swarmEpochMicros) / CALICO_TICK_MICROS);
+}
+
+void sendSyncBeacon() {
+    // Prepare a message for sending.
+    uint8_t message[MSG_MAX_SIZE] = {0};
+
+    // Insert message metadata.
+    message[0] = MSG_SYNC_BEACON;
+
+    // Insert message payload.
+    uint32_t now = getSwarmTime();
+    int i;
+    for (i = 0; i < 4; i++) {
+        message[1 + i] = (now >> (8 * i)) & 0xFF;
+    }
+
+    // Send the message, then stop it before later copies carry a stale time.
+    _sendAndHold(message, CALICO_SYNC_HOLD_MICROS);
+    kbStop(ohcFd);
 }
 
 void setMotors(uint8_t idMin, uint8_t idMax, uint8_t left, uint8_t right) {
+    _recordCommand(unitMotors, idMin, idMax, left, right, 0, 0);
+
     // Prepare a message for sending.
     uint8_t message[MSG_MAX_SIZE] = {0};
 
@@ -34,6 +338,8 @@ void setMotors(uint8_t idMin, uint8_t idMax, uint8_t left, uint8_t right) {
 }
 
 void setColor(uint8_t idMin, uint8_t idMax, uint8_t color) {
+    _recordCommand(unitColor, idMin, idMax, color, 0, 0, 0);
+
     // Prepare a message for sending.
     uint8_t message[MSG_MAX_SIZE] = {0};
 
@@ -49,6 +355,123 @@ void setColor(uint8_t idMin, uint8_t idMax, uint8_t color) {
     kbSendMessage(ohcFd, message);
 }
 
+void setMotorsAt(uint8_t idMin, uint8_t idMax, uint8_t left, uint8_t right, uint16_t execTime) {
+    _recordCommand(unitMotors, idMin, idMax, left, right, 1, execTime);
+    _sendDeferred(idMin, idMax, MSG_SET_MOTORS, left, right, execTime);
+}
+
+void setColorAt(uint8_t idMin, uint8_t idMax, uint8_t color, uint16_t execTime) {
+    _recordCommand(unitColor, idMin, idMax, color, 0, 1, execTime);
+    _sendDeferred(idMin, idMax, MSG_SET_COLOR, color, 0, execTime);
+}
+
+int uploadMacro(uint8_t slot, CalicoMacroStep* steps, uint8_t count, uint32_t holdMicros) {
+    if (slot >= CALICO_MACRO_SLOTS || count > CALICO_MACRO_MAX_STEPS) {
+        fprintf(stderr, "Cannot upload a %u step macro to slot %u.\n", count, slot);
+        return -1;
+    }
+
+    // Terminate the program unless it fills the whole slot.
+    int total = count < CALICO_MACRO_MAX_STEPS ? count + 1 : count;
+
+    int index;
+    for (index = 0; index < total; index += 2) {
+        // Prepare a message for sending.
+        uint8_t message[MSG_MAX_SIZE] = {0};
+
+        // Insert message metadata.
+        message[0] = MSG_MACRO_UPLOAD;
+        message[1] = slot;
+        message[2] = index;
+
+        // Insert up to two steps; anything past the program is MACRO_OP_END.
+        int i;
+        for (i = 0; i < 2; i++) {
+            if (index + i < count) {
+                message[3 + 3 * i] = steps[index + i].op;
+                message[4 + 3 * i] = steps[index + i].a;
+                message[5 + 3 * i] = steps[index + i].b;
+            }
+        }
+
+        // Send the message.
+        _sendAndHold(message, holdMicros);
+    }
+
+    return 0;
+}
+
+void triggerMacro(uint8_t idMin, uint8_t idMax, uint8_t slot) {
+    // Prepare a message for sending.
+    uint8_t message[MSG_MAX_SIZE] = {0};
+
+    // Advance the sequence, skipping zero so the first trigger is never ignored.
+    macroTriggerSequence += 1;
+    if (macroTriggerSequence == 0) {
+        macroTriggerSequence = 1;
+    }
+
+    // Insert message metadata.
+    message[0] = MSG_MACRO_TRIGGER;
+    message[1] = idMin;
+    message[2] = idMax;
+
+    // Insert message payload.
+    message[3] = slot;
+    message[4] = macroTriggerSequence;
+
+    // Send the message.
+    kbSendMessage(ohcFd, message);
+}
+
+void stopMacro(uint8_t idMin, uint8_t idMax) {
+    triggerMacro(idMin, idMax, CALICO_MACRO_STOP);
+}
+
+int sendBulkPayload(uint8_t idMin, uint8_t idMax, uint8_t* payload, uint8_t length, uint8_t repetitions, uint32_t holdMicros) {
+    if (length > CALICO_BULK_MAX_SIZE) {
+        fprintf(stderr, "Cannot send a %u byte bulk payload; the maximum is %u bytes.\n", length, CALICO_BULK_MAX_SIZE);
+        return -1;
+    }
+
+    bulkTransferId += 1;
+
+    int pass;
+    for (pass = 0; pass < repetitions; pass++) {
+        // Prepare a message for sending.
+        uint8_t message[MSG_MAX_SIZE] = {0};
+
+        // Announce the transfer so units know what to reassemble.
+        message[0] = MSG_BULK_BEGIN;
+        message[1] = idMin;
+        message[2] = idMax;
+        message[3] = bulkTransferId;
+        message[4] = length;
+        _sendAndHold(message, holdMicros);
+
+        // Stream the fragments.
+        int offset;
+        for (offset = 0; offset < length; offset += CALICO_BULK_FRAGMENT_SIZE) {
+            uint8_t fragment[MSG_MAX_SIZE] = {0};
+
+            // Insert message metadata.
+            fragment[0] = MSG_BULK_FRAGMENT;
+            fragment[1] = bulkTransferId;
+            fragment[2] = offset / CALICO_BULK_FRAGMENT_SIZE;
+
+            // Insert message payload.
+            int i;
+            for (i = 0; i < CALICO_BULK_FRAGMENT_SIZE && offset + i < length; i++) {
+                fragment[3 + i] = payload[offset + i];
+            }
+
+            _sendAndHold(fragment, holdMicros);
+        }
+    }
+
+    return bulkTransferId;
+}
+
 void setPos(uint8_t id, uint8_t posX, uint8_t posY, uint8_t rotZ) {
     // Prepare a message for sending.
     uint8_t message[MSG_MAX_SIZE] = {0};
@@ -17,6 +17,10 @@
  * Both of these methods should be invoked multiple times over a period to be certain that
  * the swarm is running and/or reset, depending, due to data loss.
  *
+ * If the overhead controller is lost, it is reopened on the next send or call to
+ * pollCalicoDriver(), which must be called periodically (e.g. once per control loop
+ * iteration) for an idle driver to recover.
+ *
  * TODO: Add support for multiple overhead controller addresses.
  *
  * @param overheadControllerAddress String address of the overhead controller on
@@ -46,6 +50,121 @@ void setMotors(uint8_t idMin, uint8_t idMax, uint8_t left, uint8_t right);
  */
 void setColor(uint8_t idMin, uint8_t idMax, uint8_t color);
 
+/**
+ * Checks the overhead controller for a lost connection, reopening it if needed,
+ * and advances the replay of the swarm state after a reconnect.
+ *
+ * After a reconnect, the last color and motor values sent to each unit are
+ * replayed, merging consecutive units with the same values into one ranged
+ * message; deferred commands whose time has yet to pass are replayed with their
+ * original execution time. Each call sends at most one replay message and only
+ * once the previous one has been held for 25 ms, so a call never stalls for
+ * longer than writing two packets to the overhead controller (about 70 ms at
+ * 38400 baud). The full replay takes at most 1024 messages (every unit with a
+ * distinct pending and current color and motor value), but is usually a
+ * handful. Once it completes, the message that was being sent before is resumed.
+ *
+ * @return 1 if connected, 0 if still disconnected, and -1 if the driver is not initialized.
+ */
+int pollCalicoDriver();
+
+/**
+ * Returns the current swarm time. The swarm clock starts when the driver is
+ * initialized and counts in kilo ticks (CALICO_TICK_MICROS each).
+ *
+ * @return Current swarm time in kilo ticks.
+ */
+uint32_t getSwarmTime();
+
+/**
+ * Broadcasts the current swarm time so that every kilobot can estimate the
+ * offset between its own kilo_ticks and the swarm clock. Beacons should be
+ * sent periodically (every few seconds) to correct for clock drift.
+ *
+ * The beacon is repeated for two kilo ticks and then stopped, so that no unit
+ * hears a stale timestamp; this call blocks for that long and leaves the overhead
+ * controller idle.
+ */
+void sendSyncBeacon();
+
+/**
+ * Sets the motor values on a specific range of kilobots once the swarm clock
+ * reaches execTime. Units buffer the command until then, so a whole frame can be
+ * transmitted ahead of its deadline and take effect on every unit at once.
+ *
+ * @param idMin The lowest unit ID that will receive the message.
+ * @param idMax The highest unit ID that will receive the message.
+ * @param left The speed of the left motor.
+ * @param right The speed of the right motor.
+ * @param execTime Swarm time (lower 16 bits of getSwarmTime()) at which to apply the command.
+ */
+void setMotorsAt(uint8_t idMin, uint8_t idMax, uint8_t left, uint8_t right, uint16_t execTime);
+
+/**
+ * Sets the LED color on a specific range of kilobots once the swarm clock
+ * reaches execTime.
+ *
+ * @param idMin The lowest unit ID that will receive the message.
+ * @param idMax The highest unit ID that will receive the message.
+ * @param color An 8-bit unsigned integer denoting the color to use. Use the RGB(r, g, b)
+ *              macro definition to determine this value.
+ * @param execTime Swarm time (lower 16 bits of getSwarmTime()) at which to apply the command.
+ */
+void setColorAt(uint8_t idMin, uint8_t idMax, uint8_t color, uint16_t execTime);
+
+/**
+ * Uploads a macro program into a slot on every kilobot. Each message carries two
+ * steps, and each is repeated for holdMicros before moving on, so this call blocks
+ * for roughly (count / 2 + 1) * holdMicros. Slots live in each unit's RAM, so
+ * macros must be uploaded again after kbReset() or a power cycle.
+ *
+ * @param slot Macro slot to upload into (less than CALICO_MACRO_SLOTS).
+ * @param steps Program steps, ending at the first MACRO_OP_END or MACRO_OP_REPEAT.
+ * @param count Number of steps (at most CALICO_MACRO_MAX_STEPS).
+ * @param holdMicros Time to repeat each upload message for, in microseconds.
+ *
+ * @return 0 on success, -1 if the slot or step count is out of range.
+ */
+int uploadMacro(uint8_t slot, CalicoMacroStep* steps, uint8_t count, uint32_t holdMicros);
+
+/**
+ * Starts a previously uploaded macro on a specific range of kilobots. Use an
+ * idMin of 0 and an idMax of 255 to trigger the entire swarm.
+ *
+ * @param idMin The lowest unit ID that will receive the message.
+ * @param idMax The highest unit ID that will receive the message.
+ * @param slot Macro slot to run.
+ */
+void triggerMacro(uint8_t idMin, uint8_t idMax, uint8_t slot);
+
+/**
+ * Stops the running macro on a specific range of kilobots. Motors and LEDs are
+ * left as the macro last set them.
+ *
+ * @param idMin The lowest unit ID that will receive the message.
+ * @param idMax The highest unit ID that will receive the message.
+ */
+void stopMacro(uint8_t idMin, uint8_t idMax);
+
+/**
+ * Sends a payload larger than a single message to a specific range of kilobots.
+ * The payload is split into CALICO_BULK_FRAGMENT_SIZE byte fragments which units
+ * reassemble before invoking onCalicoBulkReceived. Every pass resends the whole
+ * payload so units can fill in fragments they missed; each message is repeated
+ * for holdMicros, so this call blocks for roughly
+ * repetitions * (length / CALICO_BULK_FRAGMENT_SIZE + 2) * holdMicros.
+ *
+ * @param idMin The lowest unit ID that will receive the payload.
+ * @param idMax The highest unit ID that will receive the payload.
+ * @param payload Payload to send.
+ * @param length Length of the payload (at most CALICO_BULK_MAX_SIZE).
+ * @param repetitions Number of passes over the payload.
+ * @param holdMicros Time to repeat each message for, in microseconds.
+ *
+ * @return The ID of the transfer, or -1 if the payload is too large.
+ */
+int sendBulkPayload(uint8_t idMin, uint8_t idMax, uint8_t* payload, uint8_t length, uint8_t repetitions, uint32_t holdMicros);
+
 /**
  * Sends a message to a specific kilobot containing X/Y coordinate data.
  *
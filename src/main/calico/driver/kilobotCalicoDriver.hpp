@@ -0,0 +1,372 @@
+#ifndef KILOBOT_CALICO_DRIVER_HPP
+#define KILOBOT_CALICO_DRIVER_HPP
+
+/*
+ * Header-only C++17 bindings for Kilo Commander and the Calico protocol.
+ *
+ * Messages are described by small typed builders which encode straight into
+ * overhead controller packets. Encoding is constexpr, so packets for constant
+ * commands (STOP, RUN, RESET, or any builder with constant arguments) are
+ * produced at compile time, and other packets are written in place into a
+ * caller-owned PacketArena without touching the heap.
+ *
+ * Example:
+ *
+ *     kilo::Controller ohc(OHC_DEFAULT_ADDRESS_MACOS);
+ *     ohc.run();
+ *
+ *     kilo::PacketArena<90> frame;
+ *     for (uint8_t id = 0; id < 90; id++) {
+ *         frame.push(kilo::SetColor{id, id, kilo::rgb(3, 0, 0)});
+ *     }
+ *     for (const kilo::Packet& packet : frame) {
+ *         ohc.send(packet);
+ *         usleep(25000);
+ *     }
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "kilobotCalicoDefinitions.h"
+#include "kiloCommander.h"
+
+namespace kilo {
+
+// A complete packet for the overhead controller.
+using Packet = std::array<uint8_t, KB_PACKET_SIZE>;
+
+// A Calico message as received by a kilobot.
+using Message = std::array<uint8_t, MSG_MAX_SIZE>;
+
+/**
+ * Builds the packet that stops the overhead controller from repeating its last message.
+ */
+constexpr Packet makeStopPacket() {
+    Packet p{};
+    p[0] = KB_PACKET_HEADER;
+    p[1] = KB_PACKET_STOP;
+    p[KB_PACKET_SIZE - 1] = KB_PACKET_HEADER ^ KB_PACKET_STOP;
+    return p;
+}
+
+/**
+ * Builds a packet forwarding a message of the given kilobot type to the swarm.
+ *
+ * @param type Kilobot message type (KB_TYPE_*).
+ * @param payload Message payload.
+ */
+constexpr Packet makeDataPacket(uint8_t type, const Message& payload) {
+    Packet p{};
+    uint8_t checksum = KB_PACKET_HEADER ^ KB_PACKET_FORWARDMSG ^ type;
+
+    p[0] = KB_PACKET_HEADER;
+    p[1] = KB_PACKET_FORWARDMSG;
+    for (std::size_t i = 0; i < MSG_MAX_SIZE; i++) {
+        p[2 + i] = payload[i];
+        checksum ^= payload[i];
+    }
+    p[2 + MSG_MAX_SIZE] = type;
+    p[KB_PACKET_SIZE - 1] = checksum;
+    return p;
+}
+
+/**
+ * Builds the packet for a Calico message builder.
+ */
+template <typename M>
+constexpr Packet makePacket(const M& message) {
+    return makeDataPacket(KB_TYPE_NORMAL, message.encode());
+}
+
+inline constexpr Packet STOP_PACKET = makeStopPacket();
+inline constexpr Packet RUN_PACKET = makeDataPacket(KB_TYPE_RUN, Message{});
+inline constexpr Packet RESET_PACKET = makeDataPacket(KB_TYPE_RESET, Message{});
+
+/**
+ * Determines the color value for kilobot LEDs; equivalent to the RGB(r, g, b) macro.
+ */
+constexpr uint8_t rgb(uint8_t r, uint8_t g, uint8_t b) {
+    return (r & 3) | ((g & 3) << 2) | ((b & 3) << 4);
+}
+
+// Sets the motor values on a range of kilobots (MSG_SET_MOTORS).
+struct SetMotors {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t left;
+    uint8_t right;
+
+    constexpr Message encode() const {
+        return {MSG_SET_MOTORS, idMin, idMax, left, right};
+    }
+};
+
+// Sets the LED color on a range of kilobots (MSG_SET_COLOR).
+struct SetColor {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t color;
+
+    constexpr Message encode() const {
+        return {MSG_SET_COLOR, idMin, idMax, color};
+    }
+};
+
+// Assigns a position and rotation to a single kilobot (MSG_SET_POS).
+struct SetPos {
+    uint8_t id;
+    uint8_t posX;
+    uint8_t posY;
+    uint8_t rotZ;
+
+    constexpr Message encode() const {
+        return {MSG_SET_POS, id, posX, posY, rotZ};
+    }
+};
+
+// Sends a 6 byte message to a range of kilobots (MSG_SEND_MSG).
+struct SendMsg {
+    uint8_t idMin;
+    uint8_t idMax;
+    std::array<uint8_t, 6> payload;
+
+    constexpr Message encode() const {
+        Message m{MSG_SEND_MSG, idMin, idMax};
+        for (std::size_t i = 0; i < payload.size(); i++) {
+            m[3 + i] = payload[i];
+        }
+        return m;
+    }
+};
+
+// Sends an 8 byte message to the entire swarm (MSG_SEND_BROADCAST).
+struct SendBroadcast {
+    std::array<uint8_t, 8> payload;
+
+    constexpr Message encode() const {
+        Message m{MSG_SEND_BROADCAST};
+        for (std::size_t i = 0; i < payload.size(); i++) {
+            m[1 + i] = payload[i];
+        }
+        return m;
+    }
+};
+
+// Relays an encoded Virtual Stigmergy broadcast to the swarm (MSG_SEND_VS_BROADCAST).
+struct SendVsBroadcast {
+    std::array<uint8_t, 8> payload;
+
+    constexpr Message encode() const {
+        Message m{MSG_SEND_VS_BROADCAST};
+        for (std::size_t i = 0; i < payload.size(); i++) {
+            m[1 + i] = payload[i];
+        }
+        return m;
+    }
+};
+
+// Broadcasts the swarm time in kilo ticks (MSG_SYNC_BEACON).
+struct SyncBeacon {
+    uint32_t time;
+
+    constexpr Message encode() const {
+        return {MSG_SYNC_BEACON,
+                static_cast<uint8_t>(time),
+                static_cast<uint8_t>(time >> 8),
+                static_cast<uint8_t>(time >> 16),
+                static_cast<uint8_t>(time >> 24)};
+    }
+};
+
+// Sets the motor values on a range of kilobots at a swarm time (MSG_DEFERRED).
+struct SetMotorsAt {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t left;
+    uint8_t right;
+    uint16_t execTime;
+
+    constexpr Message encode() const {
+        return {MSG_DEFERRED, idMin, idMax, MSG_SET_MOTORS, left, right,
+                static_cast<uint8_t>(execTime), static_cast<uint8_t>(execTime >> 8)};
+    }
+};
+
+// Sets the LED color on a range of kilobots at a swarm time (MSG_DEFERRED).
+struct SetColorAt {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t color;
+    uint16_t execTime;
+
+    constexpr Message encode() const {
+        return {MSG_DEFERRED, idMin, idMax, MSG_SET_COLOR, color, 0,
+                static_cast<uint8_t>(execTime), static_cast<uint8_t>(execTime >> 8)};
+    }
+};
+
+// Uploads two steps of a macro program (MSG_MACRO_UPLOAD).
+struct MacroUpload {
+    uint8_t slot;
+    uint8_t index;
+    CalicoMacroStep first;
+    CalicoMacroStep second;
+
+    constexpr Message encode() const {
+        return {MSG_MACRO_UPLOAD, slot, index,
+                first.op, first.a, first.b,
+                second.op, second.a, second.b};
+    }
+};
+
+// Starts a macro on a range of kilobots (MSG_MACRO_TRIGGER). The sequence must
+// differ from the previous trigger's, and slot CALICO_MACRO_STOP stops the macro.
+struct MacroTrigger {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t slot;
+    uint8_t sequence;
+
+    constexpr Message encode() const {
+        return {MSG_MACRO_TRIGGER, idMin, idMax, slot, sequence};
+    }
+};
+
+// Announces a bulk transfer to a range of kilobots (MSG_BULK_BEGIN).
+struct BulkBegin {
+    uint8_t idMin;
+    uint8_t idMax;
+    uint8_t transferId;
+    uint8_t length;
+
+    constexpr Message encode() const {
+        return {MSG_BULK_BEGIN, idMin, idMax, transferId, length};
+    }
+};
+
+// Carries one fragment of a bulk transfer (MSG_BULK_FRAGMENT).
+struct BulkFragment {
+    uint8_t transferId;
+    uint8_t index;
+    std::array<uint8_t, CALICO_BULK_FRAGMENT_SIZE> data;
+
+    constexpr Message encode() const {
+        Message m{MSG_BULK_FRAGMENT, transferId, index};
+        for (std::size_t i = 0; i < data.size(); i++) {
+            m[3 + i] = data[i];
+        }
+        return m;
+    }
+};
+
+/**
+ * Fixed capacity storage for packets, owned by the caller. Messages are encoded
+ * directly into the arena, so building a frame never allocates.
+ *
+ * @tparam N Maximum number of packets.
+ */
+template <std::size_t N>
+class PacketArena {
+public:
+    /**
+     * Encodes a message into the next free packet.
+     *
+     * @return The stored packet, or nullptr if the arena is full.
+     */
+    template <typename M>
+    const Packet* push(const M& message) {
+        if (count_ == N) {
+            return nullptr;
+        }
+
+        packets_[count_] = makePacket(message);
+        return &packets_[count_++];
+    }
+
+    // Forgets all stored packets, keeping the storage for reuse.
+    void clear() { count_ = 0; }
+
+    std::size_t size() const { return count_; }
+    bool full() const { return count_ == N; }
+
+    const Packet& operator[](std::size_t i) const { return packets_[i]; }
+    const Packet* begin() const { return packets_.data(); }
+    const Packet* end() const { return packets_.data() + count_; }
+
+private:
+    std::array<Packet, N> packets_{};
+    std::size_t count_ = 0;
+};
+
+/**
+ * Owns an overhead controller connection, closing it when destroyed.
+ */
+class Controller {
+public:
+    /**
+     * Opens an overhead controller; check isOpen() for success.
+     *
+     * @param name Name of the serial interface the overhead controller is connected to.
+     */
+    explicit Controller(const char* name) : fd_(openOhc(name)) {}
+
+    ~Controller() {
+        if (isOpen()) {
+            closeOhc(fd_);
+        }
+    }
+
+    Controller(const Controller&) = delete;
+    Controller& operator=(const Controller&) = delete;
+
+    Controller(Controller&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+    Controller& operator=(Controller&& other) noexcept {
+        if (this != &other) {
+            if (isOpen()) {
+                closeOhc(fd_);
+            }
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    bool isOpen() const { return fd_ >= 0; }
+    int fd() const { return fd_; }
+
+    /**
+     * Transmits a packet; the overhead controller repeats it until the next one.
+     *
+     * @return -1 on failure.
+     */
+    int send(const Packet& packet) const { return kbSendPacket(fd_, packet.data()); }
+
+    /**
+     * Encodes and transmits a Calico message.
+     *
+     * @return -1 on failure.
+     */
+    template <typename M>
+    int send(const M& message) const { return send(makePacket(message)); }
+
+    int stop() const { return send(STOP_PACKET); }
+    int run() const { return send(RUN_PACKET); }
+    int reset() const { return send(RESET_PACKET); }
+
+    /**
+     * Checks for a lost connection and attempts to reopen it; see kbPoll().
+     *
+     * @return 1 if connected, and 0 or -1 otherwise.
+     */
+    int poll() const { return kbPoll(fd_); }
+
+private:
+    int fd_;
+};
+
+}
+
+#endif
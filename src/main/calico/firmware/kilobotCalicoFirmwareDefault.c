@@ -11,6 +11,10 @@ void onCalicoMessageReceived(uint8_t* msg) {
 
 }
 
+void onCalicoBulkReceived(uint8_t transferId, uint8_t* data, uint8_t length) {
+
+}
+
 void setup() {
 
 }
@@ -1,3 +1,5 @@
+#include <util/atomic.h>
+
 #include "kilobotCalicoFirmwareHelper.h"
 
 // Ring buffer for storing messages to broadcast.
@@ -6,6 +8,60 @@ int16_t head = 0;
 int16_t tail = 0;
 message_t buffer[CALICO_BUFFER_MAX_SIZE];
 
+// Ring buffer for received messages awaiting processing. The size must be a
+// power of two so the free-running 8-bit indices wrap cleanly.
+#define CALICO_RX_BUFFER_MAX_SIZE 8
+volatile uint8_t rxHead = 0;
+volatile uint8_t rxTail = 0;
+volatile uint16_t rxDropped = 0;
+message_t rxBuffer[CALICO_RX_BUFFER_MAX_SIZE];
+
+// Value of kilo_ticks when each queued message was received.
+uint32_t rxTicks[CALICO_RX_BUFFER_MAX_SIZE];
+
+// Swarm clock state, estimated from the driver's sync beacons.
+#define CALICO_SYNC_MAX_STEP 8
+uint32_t swarmClockOffset = 0;
+uint32_t lastBeaconTime = 0;
+uint8_t swarmClockSynced = 0;
+
+// Table of commands waiting for their execution time.
+#define CALICO_DEFERRED_MAX_SIZE 4
+
+// Age (in kilo ticks, about two minutes) after which a last applied record is
+// forgotten, keeping its 16-bit time comparable with incoming commands.
+#define CALICO_DEFERRED_APPLIED_WINDOW 4096
+typedef struct CalicoDeferredCommand {
+    uint8_t type;
+    uint8_t arg0;
+    uint8_t arg1;
+    uint16_t time;
+
+    // 1 if this slot holds a command that has yet to be applied, and 0 otherwise.
+    volatile uint8_t pending;
+} CalicoDeferredCommand;
+CalicoDeferredCommand deferred[CALICO_DEFERRED_MAX_SIZE];
+
+// Last deferred command applied to each actuator, see _getLastApplied().
+CalicoDeferredCommand lastApplied[2];
+
+// Uploaded macro programs and the state of the running one.
+CalicoMacroStep macros[CALICO_MACRO_SLOTS][CALICO_MACRO_MAX_STEPS];
+uint8_t macroSlot = CALICO_MACRO_STOP;
+uint8_t macroStep = 0;
+uint32_t macroWaitUntil = 0;
+uint8_t lastMacroTrigger = 0;
+
+// Bulk transfer reassembly state.
+#define CALICO_BULK_IDLE 0
+#define CALICO_BULK_RECEIVING 1
+#define CALICO_BULK_COMPLETE 2
+uint8_t bulkBuffer[CALICO_BULK_MAX_SIZE];
+uint8_t bulkTransferId = 0;
+uint8_t bulkLength = 0;
+uint8_t bulkState = CALICO_BULK_IDLE;
+uint16_t bulkMissing = 0;
+
 // Get next message on request.
 message_t *message_tx() {
     return getNextCalicoMessage();
@@ -16,9 +72,15 @@ void message_tx_success() {
     progressNextCalicoMessage();
 }
 
-// Process incoming messages.
+// Queue incoming messages; they are processed later from the main loop.
 void message_rx(message_t *msg, distance_measurement_t *dist) {
-    decodeAndProcessCalicoMessage(msg);
+    if ((uint8_t) (rxHead - rxTail) < CALICO_RX_BUFFER_MAX_SIZE) {
+        rxBuffer[rxHead % CALICO_RX_BUFFER_MAX_SIZE] = *msg;
+        rxTicks[rxHead % CALICO_RX_BUFFER_MAX_SIZE] = kilo_ticks;
+        rxHead += 1;
+    } else {
+        rxDropped += 1;
+    }
 }
 
 // Handle Virtual Stigmergy broadcast requests.
@@ -26,6 +88,14 @@ void onBroadcastTransmit(VsBroadcast broadcast) {
     queueVsBroadcast(broadcast);
 }
 
+// Run Calico housekeeping ahead of the user's loop.
+void calicoLoop() {
+    processReceivedCalicoMessages(CALICO_RX_BUDGET);
+    processDeferredCalicoCommands();
+    processCalicoMacro();
+    loop();
+}
+
 message_t *getNextCalicoMessage() {
     if (head - tail > 0) {
         return &buffer[tail % CALICO_BUFFER_MAX_SIZE];
@@ -52,7 +122,356 @@ int progressNextCalicoMessage() {
     }
 }
 
+void _decodeAndProcessCalicoMessage(message_t *msg, uint32_t receivedTicks);
+
+int processReceivedCalicoMessages(uint8_t budget) {
+    int processed = 0;
+
+    // Only the receive interrupt moves the head, and only this loop moves the tail.
+    while (processed < budget && rxTail != rxHead) {
+        _decodeAndProcessCalicoMessage(&rxBuffer[rxTail % CALICO_RX_BUFFER_MAX_SIZE],
+                                       rxTicks[rxTail % CALICO_RX_BUFFER_MAX_SIZE]);
+        rxTail += 1;
+        processed += 1;
+    }
+
+    return processed;
+}
+
+uint16_t getCalicoDroppedMessages() {
+    uint16_t dropped;
+
+    // The receive interrupt may update the counter between reading its two bytes.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        dropped = rxDropped;
+    }
+
+    return dropped;
+}
+
+/**
+ * Reads kilo_ticks from the main loop. The timer interrupt updates it, and a
+ * 32-bit read on the 8-bit AVR could otherwise see a half-updated value.
+ *
+ * @return Current value of kilo_ticks.
+ */
+uint32_t _getKiloTicks() {
+    uint32_t ticks;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = kilo_ticks;
+    }
+
+    return ticks;
+}
+
+uint32_t getCalicoSwarmTime() {
+    return _getKiloTicks() + swarmClockOffset;
+}
+
+/**
+ * Updates the swarm clock offset from a sync beacon's timestamp.
+ *
+ * @param beaconTime Swarm time stamped on the beacon by the driver.
+ * @param receivedTicks Value of kilo_ticks when the beacon was received.
+ */
+void _processCalicoSyncBeacon(uint32_t beaconTime, uint32_t receivedTicks) {
+    // The overhead controller repeats each beacon; only the first copy is fresh.
+    if (swarmClockSynced && beaconTime == lastBeaconTime) {
+        return;
+    }
+    lastBeaconTime = beaconTime;
+
+    uint32_t sample = beaconTime - receivedTicks;
+    int32_t error = (int32_t) (sample - swarmClockOffset);
+
+    // Jump straight to the sample on first sync or after a large error, and
+    // otherwise move halfway towards it to smooth out reception jitter.
+    if (!swarmClockSynced || error > CALICO_SYNC_MAX_STEP || error < -CALICO_SYNC_MAX_STEP) {
+        swarmClockOffset = sample;
+        swarmClockSynced = 1;
+    } else {
+        swarmClockOffset += error / 2 + error % 2;
+    }
+}
+
+/**
+ * Applies a color or motor command immediately.
+ *
+ * @param type Calico message type of the command (MSG_SET_COLOR or MSG_SET_MOTORS).
+ * @param arg0 Color, or left motor speed.
+ * @param arg1 Unused, or right motor speed.
+ */
+void _applyCalicoCommand(uint8_t type, uint8_t arg0, uint8_t arg1) {
+    if (type == MSG_SET_COLOR) {
+        set_color(arg0);
+    } else if (type == MSG_SET_MOTORS) {
+        set_motors(arg0, arg1);
+    }
+}
+
+/**
+ * Finds the last applied record for the actuator a command drives.
+ *
+ * @param type Calico message type of the command.
+ *
+ * @return The record, or NULL if the type cannot be deferred.
+ */
+CalicoDeferredCommand* _getLastApplied(uint8_t type) {
+    if (type == MSG_SET_MOTORS) {
+        return &lastApplied[0];
+    } else if (type == MSG_SET_COLOR) {
+        return &lastApplied[1];
+    } else {
+        return NULL;
+    }
+}
+
+/**
+ * Checks if two deferred commands describe the same action at the same time.
+ *
+ * @return 1 if the commands match, and 0 otherwise.
+ */
+int _isSameDeferredCommand(CalicoDeferredCommand* one, CalicoDeferredCommand* two) {
+    return one->type == two->type &&
+           one->arg0 == two->arg0 &&
+           one->arg1 == two->arg1 &&
+           one->time == two->time;
+}
+
+/**
+ * Buffers a deferred command until the swarm clock reaches its execution time.
+ *
+ * @param command Command to buffer.
+ */
+void _queueDeferredCalicoCommand(CalicoDeferredCommand command) {
+    // Without a synchronized clock there is nothing to wait for.
+    if (!swarmClockSynced) {
+        _applyCalicoCommand(command.type, command.arg0, command.arg1);
+        return;
+    }
+
+    // Ignore commands for unknown actuators, repeats of commands that have
+    // recently been applied, and commands older than the applied one.
+    uint16_t now = (uint16_t) getCalicoSwarmTime();
+    CalicoDeferredCommand* applied = _getLastApplied(command.type);
+    if (applied == NULL ||
+        (applied->type != 0 &&
+         (uint16_t) (now - applied->time) <= CALICO_DEFERRED_APPLIED_WINDOW &&
+         (int16_t) (command.time - applied->time) <= 0)) {
+        return;
+    }
+
+    // Ignore repeats of a command that is already waiting, and find a free slot.
+    int i;
+    int freeSlot = -1;
+    for (i = 0; i < CALICO_DEFERRED_MAX_SIZE; i++) {
+        if (deferred[i].pending) {
+            if (_isSameDeferredCommand(&command, &deferred[i])) {
+                return;
+            }
+        } else if (freeSlot < 0) {
+            freeSlot = i;
+        }
+    }
+
+    // Drop the command if the table is full.
+    if (freeSlot < 0) {
+        fprintf(stderr, "Dropping deferred command because the table is full.\n");
+        return;
+    }
+
+    // Publish the slot only once its contents are written.
+    deferred[freeSlot].type = command.type;
+    deferred[freeSlot].arg0 = command.arg0;
+    deferred[freeSlot].arg1 = command.arg1;
+    deferred[freeSlot].time = command.time;
+    deferred[freeSlot].pending = 1;
+}
+
+void processDeferredCalicoCommands() {
+    uint16_t now = (uint16_t) getCalicoSwarmTime();
+
+    // Forget old last applied records before their times wrap around.
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (lastApplied[i].type != 0 &&
+            (uint16_t) (now - lastApplied[i].time) > CALICO_DEFERRED_APPLIED_WINDOW) {
+            lastApplied[i].type = 0;
+        }
+    }
+
+    // Apply due commands oldest first, so newer commands win for each actuator.
+    while (1) {
+        int oldest = -1;
+        for (i = 0; i < CALICO_DEFERRED_MAX_SIZE; i++) {
+            // Execution times wrap, so compare them relative to the current time.
+            if (deferred[i].pending && (int16_t) (deferred[i].time - now) <= 0 &&
+                (oldest < 0 || (int16_t) (deferred[i].time - deferred[oldest].time) < 0)) {
+                oldest = i;
+            }
+        }
+
+        if (oldest < 0) {
+            return;
+        }
+
+        _applyCalicoCommand(deferred[oldest].type, deferred[oldest].arg0, deferred[oldest].arg1);
+        *_getLastApplied(deferred[oldest].type) = deferred[oldest];
+        deferred[oldest].pending = 0;
+    }
+}
+
+/**
+ * Stores up to two macro steps from an upload message.
+ *
+ * @param data Message data laid out as [type, slot, index, op, a, b, op, a, b].
+ */
+void _processCalicoMacroUpload(uint8_t* data) {
+    uint8_t slot = data[1];
+    uint8_t index = data[2];
+
+    if (slot >= CALICO_MACRO_SLOTS) {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < 2 && index + i < CALICO_MACRO_MAX_STEPS; i++) {
+        macros[slot][index + i].op = data[3 + 3 * i];
+        macros[slot][index + i].a = data[4 + 3 * i];
+        macros[slot][index + i].b = data[5 + 3 * i];
+    }
+}
+
+/**
+ * Starts (or stops) a macro in response to a trigger message.
+ *
+ * @param slot Slot of the macro to start, or CALICO_MACRO_STOP.
+ * @param sequence Trigger sequence number used to ignore repeated copies of the trigger.
+ */
+void _processCalicoMacroTrigger(uint8_t slot, uint8_t sequence) {
+    // The overhead controller repeats each trigger; only act on the first copy.
+    if (sequence == lastMacroTrigger) {
+        return;
+    }
+    lastMacroTrigger = sequence;
+
+    if (slot < CALICO_MACRO_SLOTS) {
+        macroSlot = slot;
+        macroStep = 0;
+        macroWaitUntil = _getKiloTicks();
+    } else {
+        macroSlot = CALICO_MACRO_STOP;
+    }
+}
+
+void processCalicoMacro() {
+    // Run until the macro waits or ends, bounded in case it repeats without waiting.
+    int executed;
+    for (executed = 0; executed < CALICO_MACRO_MAX_STEPS; executed++) {
+        uint32_t now = _getKiloTicks();
+        if (macroSlot == CALICO_MACRO_STOP || (int32_t) (macroWaitUntil - now) > 0) {
+            return;
+        }
+
+        // Running off the end of the slot is the same as an explicit end.
+        if (macroStep >= CALICO_MACRO_MAX_STEPS) {
+            macroSlot = CALICO_MACRO_STOP;
+            return;
+        }
+
+        CalicoMacroStep step = macros[macroSlot][macroStep];
+        macroStep += 1;
+
+        if (step.op == MACRO_OP_COLOR) {
+            set_color(step.a);
+        } else if (step.op == MACRO_OP_MOTORS) {
+            set_motors(step.a, step.b);
+        } else if (step.op == MACRO_OP_WAIT) {
+            macroWaitUntil = now + ((uint16_t) step.a | ((uint16_t) step.b << 8));
+        } else if (step.op == MACRO_OP_REPEAT) {
+            macroStep = 0;
+        } else {
+            macroSlot = CALICO_MACRO_STOP;
+        }
+    }
+}
+
+/**
+ * Starts reassembling a bulk transfer.
+ *
+ * @param transferId Driver assigned ID of the transfer.
+ * @param length Total payload length in bytes.
+ */
+void _processCalicoBulkBegin(uint8_t transferId, uint8_t length) {
+    // Begin messages are repeated on every pass; keep progress on the current transfer.
+    if (bulkState != CALICO_BULK_IDLE && transferId == bulkTransferId) {
+        return;
+    }
+
+    if (length > CALICO_BULK_MAX_SIZE) {
+        fprintf(stderr, "Ignoring bulk transfer %u of %u bytes because it is too large.\n", transferId, length);
+        return;
+    }
+
+    uint8_t fragments = (length + CALICO_BULK_FRAGMENT_SIZE - 1) / CALICO_BULK_FRAGMENT_SIZE;
+    bulkTransferId = transferId;
+    bulkLength = length;
+    bulkMissing = (uint16_t) ((1UL << fragments) - 1);
+    bulkState = CALICO_BULK_RECEIVING;
+
+    // Empty transfers are complete as soon as they begin.
+    if (bulkMissing == 0) {
+        bulkState = CALICO_BULK_COMPLETE;
+        onCalicoBulkReceived(bulkTransferId, bulkBuffer, bulkLength);
+    }
+}
+
+/**
+ * Stores a fragment of the bulk transfer in progress, handing the payload off
+ * to the user once every fragment has arrived.
+ *
+ * @param data Message data laid out as [type, transferId, index, 6 payload bytes].
+ */
+void _processCalicoBulkFragment(uint8_t* data) {
+    uint8_t transferId = data[1];
+    uint8_t index = data[2];
+
+    if (bulkState != CALICO_BULK_RECEIVING || transferId != bulkTransferId ||
+        index >= CALICO_BULK_MAX_FRAGMENTS || !(bulkMissing & (1U << index))) {
+        return;
+    }
+
+    // The last fragment may be partially filled.
+    uint8_t offset = index * CALICO_BULK_FRAGMENT_SIZE;
+    int i;
+    for (i = 0; i < CALICO_BULK_FRAGMENT_SIZE && offset + i < bulkLength; i++) {
+        bulkBuffer[offset + i] = data[3 + i];
+    }
+    bulkMissing &= ~(1U << index);
+
+    if (bulkMissing == 0) {
+        bulkState = CALICO_BULK_COMPLETE;
+        onCalicoBulkReceived(bulkTransferId, bulkBuffer, bulkLength);
+    }
+}
+
+uint16_t getCalicoBulkMissingFragments() {
+    return bulkMissing;
+}
+
 void decodeAndProcessCalicoMessage(message_t *msg) {
+    _decodeAndProcessCalicoMessage(msg, _getKiloTicks());
+}
+
+/**
+ * Decodes a message received using the Calico broadcast protocol and
+ * hands it off for processing.
+ *
+ * @param msg Message to decode.
+ * @param receivedTicks Value of kilo_ticks when the message was received.
+ */
+void _decodeAndProcessCalicoMessage(message_t *msg, uint32_t receivedTicks) {
 
     // Is it a VS Broadcast (most common case.)
     if (msg->data[0] == MSG_SEND_VS_BROADCAST) {
@@ -109,6 +528,47 @@ void decodeAndProcessCalicoMessage(message_t *msg) {
       // Set our motors.
       set_motors(msg->data[3], msg->data[4]);
 
+   // Is it a sync beacon carrying the driver's swarm time?
+   } else if (msg->data[0] == MSG_SYNC_BEACON) {
+      _processCalicoSyncBeacon((uint32_t) msg->data[1] |
+                               ((uint32_t) msg->data[2] << 8) |
+                               ((uint32_t) msg->data[3] << 16) |
+                               ((uint32_t) msg->data[4] << 24),
+                               receivedTicks);
+
+   // Is it a deferred command targeted towards this unit?
+   } else if (msg->data[0] == MSG_DEFERRED &&
+              msg->data[1] <= kilo_uid &&
+              msg->data[2] >= kilo_uid) {
+      // Buffer the command until its execution time.
+      CalicoDeferredCommand command;
+      command.type = msg->data[3];
+      command.arg0 = msg->data[4];
+      command.arg1 = msg->data[5];
+      command.time = (uint16_t) msg->data[6] | ((uint16_t) msg->data[7] << 8);
+      command.pending = 0;
+      _queueDeferredCalicoCommand(command);
+
+   // Is it part of a macro program?
+   } else if (msg->data[0] == MSG_MACRO_UPLOAD) {
+      _processCalicoMacroUpload(msg->data);
+
+   // Is it a macro trigger targeted towards this unit?
+   } else if (msg->data[0] == MSG_MACRO_TRIGGER &&
+              msg->data[1] <= kilo_uid &&
+              msg->data[2] >= kilo_uid) {
+      _processCalicoMacroTrigger(msg->data[3], msg->data[4]);
+
+   // Is it the start of a bulk transfer targeted towards this unit?
+   } else if (msg->data[0] == MSG_BULK_BEGIN &&
+              msg->data[1] <= kilo_uid &&
+              msg->data[2] >= kilo_uid) {
+      _processCalicoBulkBegin(msg->data[3], msg->data[4]);
+
+   // Is it a fragment of a bulk transfer?
+   } else if (msg->data[0] == MSG_BULK_FRAGMENT) {
+      _processCalicoBulkFragment(msg->data);
+
    // Unknown message; oh my!
    } else {
        fprintf(stderr, "Unknown Message RX / Kilo Type: %u / Calico Type: %u\n", msg->type, msg->data[0]);
@@ -179,7 +639,7 @@ int defaultCalicoKilobotMainSetup() {
     kilo_message_tx = message_tx;
     kilo_message_rx = message_rx;
     kilo_message_tx_success = message_tx_success;
-    kilo_start(setup, loop);
+    kilo_start(setup, calicoLoop);
 
     return 0;
 }
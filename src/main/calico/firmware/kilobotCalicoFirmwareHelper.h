@@ -9,6 +9,12 @@
 
 #include "kilobotCalicoDefinitions.h"
 
+// Maximum number of received messages processed per loop iteration. Override
+// at compile time (e.g. -DCALICO_RX_BUDGET=4) to trade loop latency for throughput.
+#ifndef CALICO_RX_BUDGET
+#define CALICO_RX_BUDGET 2
+#endif
+
 // Assume user provides setup and loop functions for Kilobot.
 extern void setup();
 extern void loop();
@@ -23,6 +29,16 @@ extern void loop();
  */
 extern void onCalicoMessageReceived(uint8_t* msg);
 
+/**
+ * This method is invoked whenever a bulk transfer (MSG_BULK_BEGIN followed by
+ * MSG_BULK_FRAGMENT messages) targeted at this unit has been fully reassembled.
+ *
+ * @param transferId Driver assigned ID of the transfer.
+ * @param data Reassembled payload. It is only valid until the next transfer begins.
+ * @param length Length of the payload in bytes.
+ */
+extern void onCalicoBulkReceived(uint8_t transferId, uint8_t* data, uint8_t length);
+
 /**
  * Returns the next available and queued message to transmit.
  *
@@ -40,6 +56,26 @@ message_t *getNextCalicoMessage();
  */
 int progressNextCalicoMessage();
 
+/**
+ * Decodes and processes messages queued by the receive interrupt. This is
+ * invoked automatically with CALICO_RX_BUDGET before every iteration of the
+ * user's loop when using {@link #defaultCalicoKilobotMainSetup()}, so
+ * onCalicoMessageReceived and onCalicoBulkReceived run from the main loop
+ * rather than from interrupt context.
+ *
+ * @param budget Maximum number of messages to process.
+ *
+ * @return The number of messages processed.
+ */
+int processReceivedCalicoMessages(uint8_t budget);
+
+/**
+ * Returns the number of received messages dropped because the receive queue was full.
+ *
+ * @return Number of dropped messages.
+ */
+uint16_t getCalicoDroppedMessages();
+
 /**
  * Decodes a message received using the Calico broadcast protocol and
  * hands it off for processing.
@@ -48,6 +84,37 @@ int progressNextCalicoMessage();
  */
 void decodeAndProcessCalicoMessage(message_t *msg);
 
+/**
+ * Returns the current swarm time, which is this unit's kilo_ticks corrected by
+ * the offset estimated from the driver's sync beacons (MSG_SYNC_BEACON).
+ *
+ * @return Current swarm time in kilo ticks.
+ */
+uint32_t getCalicoSwarmTime();
+
+/**
+ * Applies any deferred commands (MSG_DEFERRED) whose execution time has been
+ * reached on the swarm clock. This is invoked automatically before every
+ * iteration of the user's loop when using {@link #defaultCalicoKilobotMainSetup()}.
+ */
+void processDeferredCalicoCommands();
+
+/**
+ * Executes the running macro (uploaded via MSG_MACRO_UPLOAD and started via
+ * MSG_MACRO_TRIGGER) up to its next wait step. This is invoked automatically
+ * before every iteration of the user's loop when using
+ * {@link #defaultCalicoKilobotMainSetup()}.
+ */
+void processCalicoMacro();
+
+/**
+ * Returns the fragments of the bulk transfer in progress that have yet to be received.
+ *
+ * @return Bit mask where bit N is set if fragment N is still missing, or 0 if no
+ *         transfer is in progress.
+ */
+uint16_t getCalicoBulkMissingFragments();
+
 /**
  * Adds a new message to the message transmission queue. If the queue is full,
  * the message will not be added.
@@ -1,6 +1,8 @@
 #ifndef KILOBOT_CALICO_DEFINITIONS_H
 #define KILOBOT_CALICO_DEFINITIONS_H
 
+#include <stdint.h>
+
 #define MSG_MAX_SIZE 9
 
 #define MSG_SET_MOTORS 1
@@ -9,5 +11,48 @@
 #define MSG_SEND_MSG 4
 #define MSG_SEND_BROADCAST 5
 #define MSG_SEND_VS_BROADCAST 6
+#define MSG_SYNC_BEACON 7
+#define MSG_DEFERRED 8
+#define MSG_MACRO_UPLOAD 9
+#define MSG_MACRO_TRIGGER 10
+#define MSG_BULK_BEGIN 11
+#define MSG_BULK_FRAGMENT 12
+
+// Duration of a single kilo_ticks increment, in microseconds (8 MHz / 1024 / 256).
+#define CALICO_TICK_MICROS 32768
+
+// Bulk transfer dimensions. Units track missing fragments in a 16-bit mask,
+// so a transfer may span at most 16 fragments.
+#define CALICO_BULK_MAX_SIZE 96
+#define CALICO_BULK_FRAGMENT_SIZE 6
+#define CALICO_BULK_MAX_FRAGMENTS (CALICO_BULK_MAX_SIZE / CALICO_BULK_FRAGMENT_SIZE)
+
+// Macro table dimensions on each kilobot.
+#define CALICO_MACRO_SLOTS 4
+#define CALICO_MACRO_MAX_STEPS 8
+
+// Slot value that stops the running macro when triggered.
+#define CALICO_MACRO_STOP 0xFF
+
+// Macro step operations.
+#define MACRO_OP_END 0
+#define MACRO_OP_COLOR 1
+#define MACRO_OP_MOTORS 2
+#define MACRO_OP_WAIT 3
+#define MACRO_OP_REPEAT 4
+
+// A single step of a macro program.
+typedef struct CalicoMacroStep {
+    // One of the MACRO_OP_* operations.
+    uint8_t op;
+
+    // Color for MACRO_OP_COLOR, left motor for MACRO_OP_MOTORS, and the low
+    // byte of the wait duration (in kilo ticks) for MACRO_OP_WAIT.
+    uint8_t a;
+
+    // Right motor for MACRO_OP_MOTORS, and the high byte of the wait
+    // duration for MACRO_OP_WAIT.
+    uint8_t b;
+} CalicoMacroStep;
 
 #endif
@@ -1,48 +1,52 @@
 #include "kiloCommander.h"
 
 // Magic definitions.
-#define PAGE_SIZE 128
-#define PACKET_HEADER 0x55
-#define PACKET_SIZE PAGE_SIZE + 4
+#define PACKET_SIZE KB_PACKET_SIZE
 #define COMMAND_STOP 250
 #define OHC_BAUD 38400
-
-// Command packet types.
-enum {
-    PACKET_STOP,
-    PACKET_LEDTOGGLE,
-    PACKET_FORWARDMSG,
-    PACKET_FORWARDRAWMSG,
-    PACKET_BOOTPAGE
-};
-
-// Data packet types.
-typedef enum {
-    NORMAL = 0,
-    GPS,
-    SPECIAL = 0x80,
-    BOOT = 0x80,
-    BOOTPGM_PAGE,
-    BOOTPGM_SIZE,
-    RESET,
-    SLEEP,
-    WAKEUP,
-    CHARGE,
-    VOLTAGE,
-    RUN,
-    READUID,
-    CALIB
-} message_type_t;
+#define OHC_NAME_MAX 256
+#define RECONNECT_BACKOFF_MIN_MS 10
+#define RECONNECT_BACKOFF_MAX_MS 1000
 
 // Default "empty" data packet for sending commands.
 uint8_t emptyDataPacket[9] = {0};
 
+// Packet for the STOP command, sent before switching to a new data packet.
+const uint8_t stopPacket[PACKET_SIZE] = {
+    [0] = KB_PACKET_HEADER,
+    [1] = KB_PACKET_STOP,
+    [PACKET_SIZE-1] = KB_PACKET_HEADER^KB_PACKET_STOP
+};
+
 typedef struct KiloCommanderState {
     // 0 or greater if the commander driver is connected, and negative otherwise.
     int fd;
 
     // 0 if the commander driver is currently idle (not sending), and 1 otherwise.
     int sending;
+
+    // Name of the serial interface, kept so the port can be reopened.
+    char name[OHC_NAME_MAX];
+
+    // 1 if the serial port is usable, and 0 if it was lost and awaits reopening.
+    int connected;
+
+    // Earliest time (CLOCK_MONOTONIC, in milliseconds) of the next reopen attempt.
+    uint64_t nextReconnectMs;
+
+    // Delay before the next reopen attempt, doubled after every attempt and
+    // only reset once a write succeeds.
+    uint64_t backoffMs;
+
+    // Last data packet sent, replayed after reconnecting while sending.
+    uint8_t lastPacket[PACKET_SIZE];
+
+    // 1 while a reopened port is being restored, so writes that fail meanwhile
+    // do not start another reconnect.
+    int reconnecting;
+
+    // Invoked after the port is reopened; may be NULL.
+    void (*reconnectHandler)(int fd);
 } KiloCommanderState;
 
 // Fixed size support for up to eight overhead controllers.
@@ -103,22 +107,33 @@ int _insertState(KiloCommanderState KiloCommanderState) {
     return 0;
 }
 
-int openOhc(const char* name) {
+/**
+ * Reads the system's monotonic clock.
+ *
+ * @return Monotonic time in milliseconds.
+ */
+uint64_t _getMonotonicMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-    // Attempt to open port.
-    KiloCommanderState state;
-    state.fd = open(name, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
-    state.sending = 0;
+/**
+ * Opens and configures the serial port of an overhead controller.
+ *
+ * @param name Name of the serial interface/file which the overhead controller is connected to.
+ *
+ * @return The file descriptor for the opened port, or -1 on failure.
+ */
+int _openPort(const char* name) {
 
-    // Print an error on failure.
-    if (state.fd == -1) {
-        fprintf(stderr, "Unable to open overhead controller @ %s\n", name);
+    // Attempt to open port.
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
 
-    // Configure the port.
-    } else {
+    if (fd != -1) {
         // Get port options.
         struct termios options;
-        tcgetattr(state.fd, &options);
+        tcgetattr(fd, &options);
 
         // Set I/O baud.
         cfsetispeed(&options, OHC_BAUD);
@@ -140,16 +155,205 @@ int openOhc(const char* name) {
         options.c_cc[VTIME] = 0;
 
         // Apply the options.
-        tcsetattr(state.fd, TCSANOW, &options);
+        tcsetattr(fd, TCSANOW, &options);
+    }
+
+    return fd;
+}
+
+/**
+ * Marks an overhead controller as lost so that it is reopened on the next send or poll.
+ *
+ * @param state State of the lost overhead controller.
+ */
+void _markDisconnected(KiloCommanderState* state) {
+    if (state->connected) {
+        fprintf(stderr, "Lost overhead controller @ %s (FD = %d): %s\n", state->name, state->fd, strerror(errno));
+        state->connected = 0;
+    }
+}
+
+/**
+ * Writes a packet to an overhead controller, reopening it first if it was lost.
+ * Does not change what is resumed after a reconnect.
+ *
+ * @param state State of the overhead controller.
+ * @param packet PACKET_SIZE byte packet to write.
+ *
+ * @return The number of bytes written, or -1 on failure.
+ */
+int _writePacket(KiloCommanderState* state, const uint8_t *packet);
 
-        // Register state.
+/**
+ * Attempts to reopen a lost overhead controller, unless the backoff delay has
+ * yet to pass. The new port takes over the original file descriptor, so callers
+ * can keep using it. On success, the reconnect handler is invoked and then the
+ * last data packet is resumed.
+ *
+ * @param state State of the lost overhead controller.
+ *
+ * @return 1 if the overhead controller is connected, and 0 otherwise.
+ */
+int _reconnect(KiloCommanderState* state) {
+    if (state->connected || state->reconnecting) {
+        return state->connected;
+    }
+
+    uint64_t now = _getMonotonicMs();
+    if (now < state->nextReconnectMs) {
+        return 0;
+    }
+
+    // Back off before the next attempt, even if this one reopens the port,
+    // since writes to a flapping adapter may keep failing afterwards.
+    state->nextReconnectMs = now + state->backoffMs;
+    state->backoffMs *= 2;
+    if (state->backoffMs > RECONNECT_BACKOFF_MAX_MS) {
+        state->backoffMs = RECONNECT_BACKOFF_MAX_MS;
+    }
+
+    int fd = _openPort(state->name);
+    if (fd == -1 || (fd != state->fd && dup2(fd, state->fd) == -1)) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        return 0;
+    }
+
+    if (fd != state->fd) {
+        close(fd);
+    }
+
+    state->connected = 1;
+    fprintf(stderr, "Reconnected overhead controller @ %s (FD = %d).\n", state->name, state->fd);
+
+    // Let higher layers restore anything else they need. Their sends must not
+    // change what the overhead controller resumes below.
+    state->reconnecting = 1;
+
+    if (state->reconnectHandler != NULL) {
+        int sending = state->sending;
+        uint8_t lastPacket[PACKET_SIZE];
+        memcpy(lastPacket, state->lastPacket, PACKET_SIZE);
+
+        state->reconnectHandler(state->fd);
+
+        state->sending = sending;
+        memcpy(state->lastPacket, lastPacket, PACKET_SIZE);
+    }
+
+    // Resume the message the overhead controller was repeating before it was lost.
+    // A failure here leaves the port lost until the backoff delay passes.
+    if (_writePacket(state, stopPacket) >= 0 && state->sending) {
+        _writePacket(state, state->lastPacket);
+    }
+
+    state->reconnecting = 0;
+
+    return state->connected;
+}
+
+int openOhc(const char* name) {
+
+    // Attempt to open port.
+    KiloCommanderState state = {0};
+    state.fd = _openPort(name);
+    state.sending = 0;
+
+    // Print an error on failure.
+    if (state.fd == -1) {
+        fprintf(stderr, "Unable to open overhead controller @ %s\n", name);
+
+    // Register state.
+    } else {
+        strncpy(state.name, name, OHC_NAME_MAX - 1);
+        state.connected = 1;
+        state.backoffMs = RECONNECT_BACKOFF_MIN_MS;
         _insertState(state);
     }
 
     return state.fd;
 }
 
-int kiloCommanderSendMessage(int fd, uint8_t *payload, uint8_t type_int, int withPayload) {
+int closeOhc(int fd) {
+    int i;
+    for (i = 0; i < stateSize; i++) {
+        if (state[i].fd == fd) {
+            // Fill the gap with the last entry.
+            state[i] = state[stateSize - 1];
+            stateSize--;
+            return close(fd);
+        }
+    }
+
+    return -1;
+}
+
+int kbSetReconnectHandler(int fd, void (*handler)(int fd)) {
+    KiloCommanderState* state = _getState(fd);
+    if (state == NULL) {
+        return -1;
+    }
+
+    state->reconnectHandler = handler;
+    return 0;
+}
+
+int kbPoll(int fd) {
+    KiloCommanderState* state = _getState(fd);
+    if (state == NULL) {
+        return -1;
+    }
+
+    // Check for a hangup on a port that is believed to be connected.
+    if (state->connected) {
+        struct pollfd p = { .fd = state->fd, .events = POLLOUT };
+        if (poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+            errno = EIO;
+            _markDisconnected(state);
+        }
+    }
+
+    return _reconnect(state);
+}
+
+int _writePacket(KiloCommanderState* state, const uint8_t *packet) {
+    // Reopen the port if it was lost.
+    if (!_reconnect(state)) {
+        return -1;
+    }
+
+    // Publish data packet.
+    int n = write(state->fd, packet, PACKET_SIZE);
+
+    // Treat write errors other than a full buffer as a lost port, and retry once.
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        _markDisconnected(state);
+        if (!_reconnect(state)) {
+            return -1;
+        }
+        n = write(state->fd, packet, PACKET_SIZE);
+        if (n < 0) {
+            _markDisconnected(state);
+            return -1;
+        }
+    }
+
+    if (tcdrain(state->fd) == -1 && errno == EIO) {
+        _markDisconnected(state);
+    }
+
+    // The port works again, so the next loss may reconnect straight away.
+    if (n >= 0 && state->connected) {
+        state->backoffMs = RECONNECT_BACKOFF_MIN_MS;
+    }
+
+    // Return status.
+    return n;
+}
+
+int kbSendPacket(int fd, const uint8_t *packet) {
     // Exit if bad fd.
     if (!_hasState(fd)) {
         fprintf(stderr, "Cannot send data messages if the serial port is not connected (FD = %d).\n", fd);
@@ -159,30 +363,47 @@ int kiloCommanderSendMessage(int fd, uint8_t *payload, uint8_t type_int, int wit
     // Get state.
     KiloCommanderState* state = _getState(fd);
 
-    // Cast type to a char for transmission.
-    unsigned char type = (unsigned char) type_int;
-
-    // Prepare packet.
-    char packet[PACKET_SIZE + 1] = {0};
-
-    if (type == COMMAND_STOP) {
+    if (packet[1] == KB_PACKET_STOP) {
         state->sending = 0;
-
-        packet[0] = PACKET_HEADER;
-        packet[1] = PACKET_STOP;
-        packet[PACKET_SIZE-1]=PACKET_HEADER^PACKET_STOP;
     } else {
         if (state->sending) {
-            kiloCommanderSendMessage(fd, emptyDataPacket, COMMAND_STOP, 0);
+            _writePacket(state, stopPacket);
         }
 
         state->sending = 1;
 
-        uint8_t checksum = PACKET_HEADER^PACKET_FORWARDMSG^type;
+        // Remember data packets so they can be resumed after a reconnect.
+        memmove(state->lastPacket, packet, PACKET_SIZE);
+    }
+
+    return _writePacket(state, packet);
+}
+
+/**
+ * Builds an overhead controller packet.
+ *
+ * @param packet PACKET_SIZE byte buffer to build the packet in.
+ * @param payload 9-Byte payload to transmit; ignored unless withPayload is set.
+ * @param type_int Data packet type, or COMMAND_STOP.
+ * @param withPayload 1 if the payload should be included, and 0 otherwise.
+ */
+void _buildPacket(uint8_t *packet, uint8_t *payload, uint8_t type_int, int withPayload) {
+    // Cast type to a char for transmission.
+    unsigned char type = (unsigned char) type_int;
+
+    // Prepare packet.
+    memset(packet, 0, PACKET_SIZE);
+
+    if (type == COMMAND_STOP) {
+        packet[0] = KB_PACKET_HEADER;
+        packet[1] = KB_PACKET_STOP;
+        packet[PACKET_SIZE-1]=KB_PACKET_HEADER^KB_PACKET_STOP;
+    } else {
+        uint8_t checksum = KB_PACKET_HEADER^KB_PACKET_FORWARDMSG^type;
 
         // Configure as a data packet.
-        packet[0] = PACKET_HEADER;
-        packet[1] = PACKET_FORWARDMSG;
+        packet[0] = KB_PACKET_HEADER;
+        packet[1] = KB_PACKET_FORWARDMSG;
 
         // Insert payload information.
         if (withPayload) {
@@ -196,26 +417,56 @@ int kiloCommanderSendMessage(int fd, uint8_t *payload, uint8_t type_int, int wit
         packet[11] = type;
         packet[PACKET_SIZE-1] = checksum;
     }
+}
 
-    // Terminate packet.
-    packet[PACKET_SIZE] = '\0';
+int kiloCommanderSendMessage(int fd, uint8_t *payload, uint8_t type_int, int withPayload) {
+    uint8_t packet[PACKET_SIZE];
+    _buildPacket(packet, payload, type_int, withPayload);
+    return kbSendPacket(fd, packet);
+}
 
-    // Publish data packet.
-    int n = write(state->fd, packet, PACKET_SIZE);
-    tcdrain(state->fd);
+int kbSendReplayMessage(int fd, uint8_t *payload) {
+    KiloCommanderState* state = _getState(fd);
+    if (state == NULL) {
+        return -1;
+    }
+
+    uint8_t packet[PACKET_SIZE];
+    _buildPacket(packet, payload, KB_TYPE_NORMAL, 1);
+
+    // Leaves sending and lastPacket untouched, so kbResume() can restore them.
+    if (_writePacket(state, stopPacket) < 0) {
+        return -1;
+    }
+    return _writePacket(state, packet);
+}
+
+int kbResume(int fd) {
+    KiloCommanderState* state = _getState(fd);
+    if (state == NULL) {
+        return -1;
+    }
+
+    int n = _writePacket(state, stopPacket);
+    if (n >= 0 && state->sending) {
+        n = _writePacket(state, state->lastPacket);
+    }
 
-    // Return status.
     return n;
 }
 
 int kbSendMessage(int fd, uint8_t *payload) {
-    return kiloCommanderSendMessage(fd, payload, NORMAL, 1);
+    return kiloCommanderSendMessage(fd, payload, KB_TYPE_NORMAL, 1);
+}
+
+int kbStop(int fd) {
+    return kiloCommanderSendMessage(fd, emptyDataPacket, COMMAND_STOP, 0);
 }
 
 int kbReset(int fd) {
-    return kiloCommanderSendMessage(fd, emptyDataPacket, RESET, 0);
+    return kiloCommanderSendMessage(fd, emptyDataPacket, KB_TYPE_RESET, 0);
 }
 
 int kbRun(int fd) {
-    return kiloCommanderSendMessage(fd, emptyDataPacket, RUN, 0);
+    return kiloCommanderSendMessage(fd, emptyDataPacket, KB_TYPE_RUN, 0);
 }
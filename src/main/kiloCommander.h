@@ -9,9 +9,48 @@
 #include <fcntl.h>   /* File control definitions */
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <poll.h>    /* Hangup detection */
+#include <time.h>    /* Monotonic clock for reconnect backoff */
 
 #define OHC_DEFAULT_ADDRESS_MACOS "/dev/tty.usbserial-A904R919"
 
+// Size of a packet sent to the overhead controller (a 128 byte page plus framing).
+#define KB_PACKET_SIZE 132
+
+// First byte of every packet sent to the overhead controller.
+#define KB_PACKET_HEADER 0x55
+
+// Command packet types, sent as the second byte of a packet.
+enum {
+    KB_PACKET_STOP,
+    KB_PACKET_LEDTOGGLE,
+    KB_PACKET_FORWARDMSG,
+    KB_PACKET_FORWARDRAWMSG,
+    KB_PACKET_BOOTPAGE
+};
+
+// Data packet types, sent after the payload of a KB_PACKET_FORWARDMSG packet.
+enum {
+    KB_TYPE_NORMAL = 0,
+    KB_TYPE_GPS,
+    KB_TYPE_SPECIAL = 0x80,
+    KB_TYPE_BOOT = 0x80,
+    KB_TYPE_BOOTPGM_PAGE,
+    KB_TYPE_BOOTPGM_SIZE,
+    KB_TYPE_RESET,
+    KB_TYPE_SLEEP,
+    KB_TYPE_WAKEUP,
+    KB_TYPE_CHARGE,
+    KB_TYPE_VOLTAGE,
+    KB_TYPE_RUN,
+    KB_TYPE_READUID,
+    KB_TYPE_CALIB
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Opens an overhead controller on the specified serial interface.
  *
@@ -21,6 +60,46 @@
  */
 int openOhc(const char* name);
 
+/**
+ * Closes an overhead controller opened with openOhc().
+ *
+ * @param fd File descriptor of the overhead controller.
+ *
+ * @return -1 on failure.
+ */
+int closeOhc(int fd);
+
+/**
+ * Sets a function to invoke after an overhead controller is reopened following
+ * a lost connection, so that callers can restore the state of the swarm.
+ *
+ * Lost connections are detected when a write fails or the port hangs up. The port
+ * is then reopened under the same file descriptor, with a backoff between
+ * attempts of 10 ms doubling up to 1 s, on the next send or call to kbPoll().
+ * Once reopened, the handler is invoked and the message that was being
+ * transmitted is then resumed. Handlers that need to send several messages should
+ * use kbSendReplayMessage() and spread them over later calls, finishing with
+ * kbResume(), rather than blocking the send that noticed the reconnect.
+ *
+ * @param fd File descriptor of the overhead controller.
+ * @param handler Function to invoke with fd after reconnecting, or NULL for none.
+ *
+ * @return -1 if fd is not an open overhead controller.
+ */
+int kbSetReconnectHandler(int fd, void (*handler)(int fd));
+
+/**
+ * Checks whether an overhead controller has hung up and, if it was lost,
+ * attempts to reopen it. Call this periodically while not sending to recover
+ * from disconnects in the background.
+ *
+ * @param fd File descriptor of the overhead controller.
+ *
+ * @return 1 if connected, 0 if still disconnected, and -1 if fd is not an open
+ *         overhead controller.
+ */
+int kbPoll(int fd);
+
 /**
  * Transmits a message to the kilobot swarm from the overhead controller.
  *
@@ -31,6 +110,50 @@ int openOhc(const char* name);
  */
 int kbSendMessage(int fd, uint8_t *payload);
 
+/**
+ * Transmits a message to the kilobot swarm without replacing the message that is
+ * resumed after a reconnect or by kbResume(). Intended for restoring swarm state
+ * after a reconnect.
+ *
+ * @param fd File descriptor for the overhead controller to send this message on.
+ * @param payload 9-Byte payload to transmit.
+ *
+ * @return -1 on failure.
+ */
+int kbSendReplayMessage(int fd, uint8_t *payload);
+
+/**
+ * Retransmits the last message sent with kbSendMessage() or kbSendPacket(), or
+ * stops the overhead controller if it was last stopped. Use this after a series
+ * of kbSendReplayMessage() calls.
+ *
+ * @param fd File descriptor for the overhead controller.
+ *
+ * @return -1 on failure.
+ */
+int kbResume(int fd);
+
+/**
+ * Transmits a fully formed overhead controller packet, such as one built ahead
+ * of time by the C++ bindings. Packets other than STOP are repeated by the
+ * overhead controller until the next packet is sent.
+ *
+ * @param fd File descriptor for the overhead controller to send this packet on.
+ * @param packet KB_PACKET_SIZE byte packet, including its header and checksum.
+ *
+ * @return -1 on failure.
+ */
+int kbSendPacket(int fd, const uint8_t *packet);
+
+/**
+ * Stops the overhead controller from repeating the last transmitted message.
+ *
+ * @param fd File descriptor for the overhead controller.
+ *
+ * @return -1 on failure.
+ */
+int kbStop(int fd);
+
 /**
  * Transmits the RUN command to the kilobot swarm from the overhead controller.
  *
@@ -49,4 +172,8 @@ int kbRun(int fd);
  */
 int kbReset(int fd);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif